@@ -36,11 +36,17 @@ MyPitchShiftAudioProcessorEditor::MyPitchShiftAudioProcessorEditor (MyPitchShift
     mTranspoThreeSlider.addListener(this);
 
     mWindowSizeMs.setTextBoxStyle(juce::Slider::TextBoxBelow, false, 100, 25);
-    mWindowSizeMs.setRange(5.0, 300.0, 0.1);
+    mWindowSizeMs.setRange(MIN_WINDOW_SIZE_MS, MAX_WINDOW_SIZE_MS, 0.1);
     mWindowSizeMs.setValue(audioProcessor.mWindowSizeMs);
     addAndMakeVisible(&mWindowSizeMs);
     mWindowSizeMs.addListener(this);
     
+    mAdaptiveWindowButton.setButtonText("Adaptive Window");
+    mAdaptiveWindowButton.setToggleState(audioProcessor.mAdaptiveWindow, juce::dontSendNotification);
+    mAdaptiveWindowButton.setColour (juce::ToggleButton::textColourId, juce::Colours::black);
+    addAndMakeVisible(&mAdaptiveWindowButton);
+    mAdaptiveWindowButton.addListener(this);
+    
     addAndMakeVisible (&mTranspoLabelOne);
     mTranspoLabelOne.setText ("Transposition Voice 1", juce::dontSendNotification);
     mTranspoLabelOne.attachToComponent (&mTranspoOneSlider, true);
@@ -82,6 +88,8 @@ MyPitchShiftAudioProcessorEditor::~MyPitchShiftAudioProcessorEditor()
     mTranspoThreeSlider.removeListener(this);
     
     mWindowSizeMs.removeListener(this);
+    
+    mAdaptiveWindowButton.removeListener(this);
 }
 
 //==============================================================================
@@ -101,41 +109,24 @@ void MyPitchShiftAudioProcessorEditor::sliderValueChanged(juce::Slider* slider)
     
     if (slider == &mTranspoOneSlider)
     {
-        double phasorFreq;
-
+        // the processor derives the grain rates from mTranspo every block
         audioProcessor.mTranspo[0] = mTranspoOneSlider.getValue();
 
-        phasorFreq = atec::Utilities::transpo2freq(audioProcessor.mTranspo[0], audioProcessor.mWindowSizeMs);
-        audioProcessor.setPhasorFreq(phasorFreq, 0);
-
         DBG("Transpo: " + juce::String(audioProcessor.mTranspo[0]));
-        DBG("Freq: " + juce::String(phasorFreq));
     }
 
     if (slider == &mTranspoTwoSlider)
     {
-        double phasorFreq;
-
         audioProcessor.mTranspo[1] = mTranspoOneSlider.getValue();
 
-        phasorFreq = atec::Utilities::transpo2freq(audioProcessor.mTranspo[1], audioProcessor.mWindowSizeMs);
-        audioProcessor.setPhasorFreq(phasorFreq, 1);
-
         DBG("Transpo: " + juce::String(audioProcessor.mTranspo[1]));
-        DBG("Freq: " + juce::String(phasorFreq));
     }
 
     if (slider == &mTranspoThreeSlider)
     {
-        double phasorFreq;
-
         audioProcessor.mTranspo[2] = mTranspoOneSlider.getValue();
 
-        phasorFreq = atec::Utilities::transpo2freq(audioProcessor.mTranspo[2], audioProcessor.mWindowSizeMs);
-        audioProcessor.setPhasorFreq(phasorFreq, 2);
-
         DBG("Transpo: " + juce::String(audioProcessor.mTranspo[2]));
-        DBG("Freq: " + juce::String(phasorFreq));
     }
 }
 void MyPitchShiftAudioProcessorEditor::comboBoxChanged(juce::ComboBox* comboBox)
@@ -168,6 +159,17 @@ void MyPitchShiftAudioProcessorEditor::comboBoxChanged(juce::ComboBox* comboBox)
     }
 }
 
+void MyPitchShiftAudioProcessorEditor::buttonClicked(juce::Button* button)
+{
+    if (button == &mAdaptiveWindowButton)
+    {
+        // in adaptive mode the window size slider is only used when no pitch is detected
+        audioProcessor.mAdaptiveWindow = mAdaptiveWindowButton.getToggleState();
+
+        DBG("Adaptive window: " + juce::String(audioProcessor.mAdaptiveWindow ? "on" : "off"));
+    }
+}
+
 void MyPitchShiftAudioProcessorEditor::paint (juce::Graphics& g)
 {
     // (Our component is opaque, so we must completely fill the background with a solid colour)
@@ -182,6 +184,7 @@ void MyPitchShiftAudioProcessorEditor::resized()
     mTranspoTwoSlider.setBounds(150,100,300,50);
     mTranspoThreeSlider.setBounds(150,150,300,50);
     mWindowSizeMs.setBounds(150,250, 300, 50);
+    mAdaptiveWindowButton.setBounds(460,250,130,25);
     mHarmPresetComboBox.setBounds(390,290,50,50);
     
 }
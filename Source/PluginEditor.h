@@ -14,7 +14,7 @@
 //==============================================================================
 /**
 */
-class MyPitchShiftAudioProcessorEditor  : public juce::AudioProcessorEditor, public juce::Slider::Listener, public juce::ComboBox::Listener
+class MyPitchShiftAudioProcessorEditor  : public juce::AudioProcessorEditor, public juce::Slider::Listener, public juce::ComboBox::Listener, public juce::Button::Listener
 {
 public:
     MyPitchShiftAudioProcessorEditor (MyPitchShiftAudioProcessor&);
@@ -41,6 +41,8 @@ private:
     
     juce::Label mWindowSizeLabel;
     
+    juce::ToggleButton mAdaptiveWindowButton;
+    
     juce::ComboBox mHarmPresetComboBox;
     
     enum HarmPreset
@@ -53,6 +55,7 @@ private:
 
     void sliderValueChanged(juce::Slider* slider) override;
     void comboBoxChanged(juce::ComboBox* comboBox) override;
+    void buttonClicked(juce::Button* button) override;
     
     
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (MyPitchShiftAudioProcessorEditor)
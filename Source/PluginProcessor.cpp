@@ -26,6 +26,7 @@ MyPitchShiftAudioProcessor::MyPitchShiftAudioProcessor()
         mTranspo[voice] = 0.0;
     
     mWindowSizeMs = 50.0;
+    mAdaptiveWindow = false;
 }
 
 MyPitchShiftAudioProcessor::~MyPitchShiftAudioProcessor()
@@ -33,38 +34,154 @@ MyPitchShiftAudioProcessor::~MyPitchShiftAudioProcessor()
 }
 
 //==============================================================================
-void MyPitchShiftAudioProcessor::setPhasorType(atec::LFO::LfoType t)
+void MyPitchShiftAudioProcessor::initReaders()
 {
+    mTargetWindowSamps = mWindowSizeSamps;
+    mAdaptiveWindowSamps = 0.0;
+    mPendingOnsetSamps = -1;
+    
+    // 5ms crossfade from the old grain pair to the new one after an onset
+    mFadeStep = 1.0 / (0.005 * mSampleRate);
+    
     for (int voice = 0; voice < NUM_VOICES; ++voice)
     {
-        // make sure to set the Left and Right channel
-        mPhasors[voice][0].setType(t);
-        mPhasors[voice][1].setType(t);
+        mDelaySlope[voice] = 0.0;
+        
+        for (int channel = 0; channel < 2; ++channel)
+        {
+            // reader A starts at phase 0 (silent) and reader B at 0.5 (full gain)
+            restartGrainPair(mGrainPairs[voice][channel], 0.0, mWindowSizeSamps);
+            
+            mFadeGain[voice][channel] = 0.0;
+            mFadePairs[voice][channel] = mGrainPairs[voice][channel];
+        }
     }
 }
 
-void MyPitchShiftAudioProcessor::setPhasorFreq(double f, int phasorIndex)
+void MyPitchShiftAudioProcessor::initAnalysis()
 {
-    mPhasors[phasorIndex][0].setFreq(f);
-    mPhasors[phasorIndex][1].setFreq(f);
+    // low pass the pitch tracker input around 1kHz so upper harmonics don't add extra zero crossings
+    mPitchLowpassCoeff = 1.0 - std::exp (-2.0 * juce::MathConstants<double>::pi * 1000.0 / mSampleRate);
+    mPitchLowpassState = 0.0;
+    mPitchArmed = false;
+    mSamplesSinceCrossing = 0;
+    mPitchPeriodSamps = 0.0;
+    
+    // the fast envelope releases over ~50ms, longer than the longest tracked period (20ms), so it follows the level and not the
+    // waveform inside each period. the slow one averages it over ~100ms
+    mFastEnvReleaseCoeff = 1.0 - std::exp (-1.0 / (0.05 * mSampleRate));
+    mSlowEnvCoeff = 1.0 - std::exp (-1.0 / (0.1 * mSampleRate));
+    mFastEnv = 0.0;
+    mSlowEnv = 0.0;
+    mOnsetArmed = true;
 }
 
-void MyPitchShiftAudioProcessor::setPhasorDebug(bool d)
+int MyPitchShiftAudioProcessor::analyseBlock(const juce::AudioBuffer<float>& buffer, int numChannels)
 {
-    for (int voice = 0; voice < NUM_VOICES; ++voice)
+    // shortest and longest pitch periods we'll track (1kHz down to 50Hz)
+    int minPeriodSamps = mSampleRate / 1000.0;
+    int maxPeriodSamps = mSampleRate / 50.0;
+    // index of the first onset in this block, -1 if there wasn't one
+    int onsetSample = -1;
+    
+    for (int sample = 0; sample < buffer.getNumSamples(); ++sample)
     {
-        mPhasors[voice][0].debug(d);
-        mPhasors[voice][1].debug(d);
+        double x = 0.0;
+        double rectified;
+        double hysteresis;
+        
+        // mix down to mono for analysis
+        for (int channel = 0; channel < numChannels; ++channel)
+            x += buffer.getSample(channel, sample);
+        x /= juce::jmax (numChannels, 1);
+        
+        // **** ONSET DETECTOR
+        //
+        // the fast envelope is a peak follower (instant attack) that jumps ahead of the slow one on a transient
+        rectified = std::abs (x);
+        if (rectified > mFastEnv)
+            mFastEnv = rectified;
+        else
+            mFastEnv += mFastEnvReleaseCoeff * (rectified - mFastEnv);
+        mSlowEnv += mSlowEnvCoeff * (mFastEnv - mSlowEnv);
+        
+        // an onset needs the level to at least double (+6dB) and to jump by a real amount, so ripple on held notes and noise in
+        // near silence don't count
+        if (mOnsetArmed && mFastEnv > 2.0 * mSlowEnv && mFastEnv - mSlowEnv > 0.02)
+        {
+            if (onsetSample < 0)
+                onsetSample = sample;
+            // don't fire again until the slow envelope has caught up, so one transient gives one reset
+            mOnsetArmed = false;
+        }
+        else if (mFastEnv < 1.5 * mSlowEnv)
+            mOnsetArmed = true;
+        
+        // **** PITCH TRACKER
+        //
+        // time the positive going zero crossings of the low passed signal, with a little hysteresis so noise doesn't count
+        mPitchLowpassState += mPitchLowpassCoeff * (x - mPitchLowpassState);
+        hysteresis = 0.1 * mSlowEnv;
+        // nothing reads the count past two of the longest periods, so stop there rather than let it overflow in long silences
+        if (mSamplesSinceCrossing <= 2 * maxPeriodSamps)
+            ++mSamplesSinceCrossing;
+        
+        if (mPitchLowpassState < -hysteresis)
+            mPitchArmed = true;
+        else if (mPitchArmed && mPitchLowpassState > hysteresis)
+        {
+            mPitchArmed = false;
+            
+            if (mSamplesSinceCrossing >= minPeriodSamps && mSamplesSinceCrossing <= maxPeriodSamps)
+            {
+                // smooth the estimate so one stray crossing doesn't yank the window around
+                if (mPitchPeriodSamps > 0.0)
+                    mPitchPeriodSamps += 0.2 * (mSamplesSinceCrossing - mPitchPeriodSamps);
+                else
+                    mPitchPeriodSamps = mSamplesSinceCrossing;
+            }
+            
+            mSamplesSinceCrossing = 0;
+        }
+        
+        // no crossing for two of the longest periods, or near silence, means there's no pitch to follow
+        if (mSamplesSinceCrossing > 2 * maxPeriodSamps || mSlowEnv < 0.001)
+            mPitchPeriodSamps = 0.0;
     }
+    
+    return onsetSample;
 }
 
-void MyPitchShiftAudioProcessor::initPhasor()
+double MyPitchShiftAudioProcessor::computeTargetWindowSamps(int numSamples)
 {
-    for (int voice = 0; voice < NUM_VOICES; ++voice)
+    double minWindowSamps, maxWindowSamps;
+    
+    // use the window size slider when adaptive mode is off, and forget the last detected window so re-enabling starts fresh
+    if (!mAdaptiveWindow)
     {
-        mPhasors[voice][0].init();
-        mPhasors[voice][1].init();
+        mAdaptiveWindowSamps = 0.0;
+        return mWindowSizeSamps;
     }
+    
+    if (mPitchPeriodSamps > 0.0)
+    {
+        minWindowSamps = atec::Utilities::sec2samp(MIN_WINDOW_SIZE_MS / 1000.0, mSampleRate);
+        maxWindowSamps = atec::Utilities::sec2samp(MAX_WINDOW_SIZE_MS / 1000.0, mSampleRate);
+        
+        mAdaptiveWindowSamps = juce::jlimit (minWindowSamps, maxWindowSamps, ADAPTIVE_WINDOW_PERIODS * mPitchPeriodSamps);
+    }
+    else if (mAdaptiveWindowSamps > 0.0)
+    {
+        // pitch dropped out (gap between notes, consonant, noisy attack): hold the last window, drifting toward the slider value over ~10 seconds
+        mAdaptiveWindowSamps += (1.0 - std::exp (-numSamples / (10.0 * mSampleRate))) * (mWindowSizeSamps - mAdaptiveWindowSamps);
+    }
+    else
+    {
+        // no pitch yet since adaptive mode was turned on
+        return mWindowSizeSamps;
+    }
+    
+    return mAdaptiveWindowSamps;
 }
 
 const juce::String MyPitchShiftAudioProcessor::getName() const
@@ -137,26 +254,15 @@ void MyPitchShiftAudioProcessor::prepareToPlay (double sampleRate, int samplesPe
 
     // initialize mWindowSizeSamps now that we know the sampling rate
     mWindowSizeSamps = atec::Utilities::sec2samp(mWindowSizeMs / 1000.0, mSampleRate);
+    
+    initReaders();
+    initAnalysis();
 
     mRingBuf.debug(false);
     // since our window size max is 300ms, the largest delay time we'll need is 0.3 * mSampleRate.
     // we'll bump that up to a second so there's more than enough space.
     mRingBuf.setSize(mNumInputChannels, 1.0 * mSampleRate, mBlockSize);
     mRingBuf.init();
-    
-    // turn on/off debug mode for all the phasor LFOs
-    setPhasorDebug(false);
-    // set the LFO type to saw for a 0-1 normalized phasor signal
-    setPhasorType(atec::LFO::saw);
-    // initialize phasor frequency with current mTranspo value
-    for (int voice = 0; voice < NUM_VOICES; ++voice)
-    {
-        double phasorFreq = atec::Utilities::transpo2freq(mTranspo[voice], mWindowSizeMs);
-        
-        setPhasorFreq(phasorFreq, voice);
-    }
-    
-    initPhasor();
 }
 
 void MyPitchShiftAudioProcessor::releaseResources()
@@ -192,51 +298,159 @@ bool MyPitchShiftAudioProcessor::isBusesLayoutSupported (const BusesLayout& layo
 #endif
 
 
-void MyPitchShiftAudioProcessor::computeDelayAndAmp(double phaseSample, double* envSignalPtr, double* delaySignalPtr)
+void MyPitchShiftAudioProcessor::computeDelayAndAmp(double phaseSample, double windowSizeSamps, double* envSignalPtr, double* delaySignalPtr)
 {
     if (envSignalPtr && delaySignalPtr)
     {
         *envSignalPtr = std::sin (phaseSample * juce::MathConstants<double>::pi);
-        *delaySignalPtr = phaseSample * mWindowSizeSamps;
+        *delaySignalPtr = phaseSample * windowSizeSamps;
     }
 }
 
 
-double MyPitchShiftAudioProcessor::computeTranspoSamples(int voice, int channel, int sample)
+void MyPitchShiftAudioProcessor::latchGrain(GrainReader& reader, double phase, double windowSizeSamps)
 {
-    double phasorSampleA, phasorSampleB;
-    double envSignalA, envSignalB;
-    double delayTimeSignalA, delayTimeSignalB;
-    double sampleA, sampleB;
+    double envSignal;
     
-    // must call getNextSample() exactly once per sample
-    phasorSampleA = mPhasors[voice][channel].getNextSample();
-    // use the A reader's phasor and add 0.5, mod at 1.0 so that both phasor signals are guaranteed to be locked in a 180 degree out of phase relationship
-    phasorSampleB = std::fmod (phasorSampleA + 0.5, 1.0);
-
-    // phasor signal is in 0-1 range. it is multiplied by pi to become an angle for a sin function for amplitude enveloping (positive part of sin function), and by the window size in samples to become a delay time signal for steady change in delay time
-    computeDelayAndAmp(phasorSampleA, &envSignalA, &delayTimeSignalA);
+    // start of a new grain: pick up the window and hold it until the grain ends
+    reader.windowSizeSamps = windowSizeSamps;
+    computeDelayAndAmp(phase, reader.windowSizeSamps, &envSignal, &reader.delaySamps);
+}
 
-    // same for the B reader
-    computeDelayAndAmp(phasorSampleB, &envSignalB, &delayTimeSignalB);
-    // **** READER A
-    //
+double MyPitchShiftAudioProcessor::readGrain(const GrainReader& reader, double phase, int channel, int sample, double* envSignalPtr)
+{
+    double phaseDelay;
+    
+    // phase signal is in 0-1 range. it is multiplied by pi to become an angle for a sin function for amplitude enveloping (positive part of sin function)
+    computeDelayAndAmp(phase, reader.windowSizeSamps, envSignalPtr, &phaseDelay);
+    
     // get the interpolated sample
-    // must offset the sample index i by -mWindowSizeSamps so that the delay ramping starts behind the RingBuffer write index by mWindowSizeSamps at a minimum
-    sampleA = mRingBuf.readInterpSample (channel, sample - mWindowSizeSamps, delayTimeSignalA);
-    // apply amplitude envelope
-    sampleA *= envSignalA;
+    // must offset the sample index i by -windowSizeSamps so that the delay ramping starts behind the RingBuffer write index by windowSizeSamps at a minimum
+    return mRingBuf.readInterpSample (channel, sample - reader.windowSizeSamps, reader.delaySamps);
+}
 
+double MyPitchShiftAudioProcessor::nextHalfWindowSamps(double windowSizeSamps)
+{
+    // a grain's delay travel covers the windows of both of its halves. for upward transpositions the delay starts at the
+    // first half's window and runs down, so the second half's window must stay under 3 times the first, or the read head
+    // would pass the write head. limit each step to a factor of 2; large changes just take a few half grains
+    return juce::jlimit (0.5 * windowSizeSamps, 2.0 * windowSizeSamps, mTargetWindowSamps);
+}
 
+void MyPitchShiftAudioProcessor::restartGrainPair(GrainPair& pair, double delaySlope, double windowSizeSamps)
+{
+    // reader A starts a new grain at its silent end (phase 1 when the phase runs downwards for upward transpositions),
+    // and reader B half a grain away at full gain
+    pair.phase = delaySlope < 0.0 ? 1.0 : 0.0;
+    pair.windowSizeSamps = windowSizeSamps;
+    pair.forcedCycling = false;
+    
+    latchGrain(pair.readers[0], pair.phase, windowSizeSamps);
+    latchGrain(pair.readers[1], 0.5, windowSizeSamps);
+}
+
+bool MyPitchShiftAudioProcessor::grainWindowsOutdated(const GrainPair& pair)
+{
+    // small differences (vibrato, tracker jitter) aren't worth cycling grains for
+    return std::abs (pair.readers[0].windowSizeSamps - mTargetWindowSamps) > 0.1 * mTargetWindowSamps
+        || std::abs (pair.readers[1].windowSizeSamps - mTargetWindowSamps) > 0.1 * mTargetWindowSamps;
+}
+
+double MyPitchShiftAudioProcessor::computeGrainPair(GrainPair& pair, int channel, int sample, double delaySlope, bool* wrappedAPtr)
+{
+    double phaseA, phaseB, prevPhase, phaseRate;
+    double envSignalA, envSignalB;
+    double sampleA, sampleB;
+    double correlation, envGain;
+    
+    // normally the phase runs at the read head slope, so a grain's delay travel matches its window.
+    // when forced, it runs faster than the slope so window changes get picked up at (near) zero transposition
+    if (pair.forcedCycling)
+        phaseRate = delaySlope < 0.0 ? -FORCED_GRAIN_RATE : FORCED_GRAIN_RATE;
+    else
+        phaseRate = delaySlope;
+    
+    prevPhase = pair.phase;
+    pair.phase += phaseRate / pair.windowSizeSamps;
+    
+    pair.readers[0].delaySamps += delaySlope;
+    pair.readers[1].delaySamps += delaySlope;
+    
+    *wrappedAPtr = pair.phase >= 1.0 || pair.phase < 0.0;
+    
+    // every half grain one of the readers starts a new grain at its silent point: update the phase speed and latch that reader
+    if (*wrappedAPtr)
+    {
+        pair.phase -= std::floor (pair.phase);
+        pair.windowSizeSamps = nextHalfWindowSamps(pair.windowSizeSamps);
+        latchGrain(pair.readers[0], pair.phase, pair.windowSizeSamps);
+    }
+    else if ((prevPhase < 0.5) != (pair.phase < 0.5))
+    {
+        pair.windowSizeSamps = nextHalfWindowSamps(pair.windowSizeSamps);
+        latchGrain(pair.readers[1], std::fmod (pair.phase + 0.5, 1.0), pair.windowSizeSamps);
+    }
+    
+    // use the A reader's phase and add 0.5, mod at 1.0 so that both readers are locked in a 180 degree out of phase relationship
+    phaseA = pair.phase;
+    phaseB = std::fmod (phaseA + 0.5, 1.0);
+    
+    // **** READER A
+    sampleA = readGrain(pair.readers[0], phaseA, channel, sample, &envSignalA);
+    
     // **** READER B
+    sampleB = readGrain(pair.readers[1], phaseB, channel, sample, &envSignalB);
+    
+    // near zero transposition both readers play nearly the same audio, so the sin envelopes (which sum to between 1 and 1.41)
+    // would cause tremolo. blend toward envelopes normalised to sum to 1 as the slope approaches zero
+    correlation = juce::jlimit (0.0, 1.0, 1.0 - std::abs (delaySlope) / MIN_GRAIN_RATE);
+    envGain = (1.0 - correlation) + correlation / (envSignalA + envSignalB);
+    
+    // apply amplitude envelopes and add the A and B signals together for output
+    return envGain * (envSignalA * sampleA + envSignalB * sampleB);
+}
+
+double MyPitchShiftAudioProcessor::computeTranspoSamples(int voice, int channel, int sample, bool onset)
+{
+    GrainPair& pair = mGrainPairs[voice][channel];
+    double delaySlope = mDelaySlope[voice];
+    double output, fadeOutput;
+    bool wrappedA;
+    
+    if (onset)
+    {
+        // hand the playing grain pair over to the fade out, then start a fresh pair on the transient
+        mFadePairs[voice][channel] = pair;
+        mFadeGain[voice][channel] = 1.0;
+        
+        restartGrainPair(pair, delaySlope, mTargetWindowSamps);
+    }
+    
+    // at (or near) zero transposition grains barely cycle, so window changes would never be picked up.
+    // cycle them at a minimum rate only while a window is out of date
+    if (std::abs (delaySlope) >= MIN_GRAIN_RATE)
+        pair.forcedCycling = false;
+    else if (!pair.forcedCycling && grainWindowsOutdated(pair))
+        pair.forcedCycling = true;
+    
+    output = computeGrainPair(pair, channel, sample, delaySlope, &wrappedA);
+    
+    // stop forced cycling where A has just wrapped, so the pair parks with A silent and B at full gain
+    if (pair.forcedCycling && wrappedA && !grainWindowsOutdated(pair))
+        pair.forcedCycling = false;
+    
+    // **** FADING GRAIN PAIR
     //
-    // get the interpolated sample
-    sampleB = mRingBuf.readInterpSample (channel, sample - mWindowSizeSamps, delayTimeSignalB);
-    // apply amplitude envelope
-    sampleB *= envSignalB;
-     
-    // add the A and B signals together for output
-    return sampleA + sampleB;
+    // the pair that was playing before an onset keeps running on its own while it fades out under the new pair
+    if (mFadeGain[voice][channel] > 0.0)
+    {
+        fadeOutput = computeGrainPair(mFadePairs[voice][channel], channel, sample, delaySlope, &wrappedA);
+        
+        output = (1.0 - mFadeGain[voice][channel]) * output + mFadeGain[voice][channel] * fadeOutput;
+        mFadeGain[voice][channel] = juce::jmax (0.0, mFadeGain[voice][channel] - mFadeStep);
+    }
+    
+    return output;
 }
 
 void MyPitchShiftAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages)
@@ -245,6 +459,7 @@ void MyPitchShiftAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer,
     auto totalNumInputChannels  = getTotalNumInputChannels();
     auto totalNumOutputChannels = getTotalNumOutputChannels();
     auto bufSize = buffer.getNumSamples();
+    int onsetSample = -1;
 
     // In case we have more outputs than inputs, this code clears any output
     // channels that didn't contain input data, (because these aren't
@@ -271,6 +486,31 @@ void MyPitchShiftAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer,
 //        }
 //    }
     
+    // track pitch and look for transients in the incoming block before it gets cleared
+    int blockOnsetSample = analyseBlock(buffer, totalNumInputChannels);
+    
+    // the window new grains will latch at their next phasor wrap
+    mTargetWindowSamps = computeTargetWindowSamps(bufSize);
+    
+    // in adaptive mode, re-align the grains on a transient. the readers trail the write head by about a window,
+    // so schedule the re-alignment for when the transient reaches them, which may be in a later block
+    if (!mAdaptiveWindow)
+        mPendingOnsetSamps = -1;
+    else if (blockOnsetSample >= 0 && mPendingOnsetSamps < 0)
+        mPendingOnsetSamps = blockOnsetSample + (int) mTargetWindowSamps;
+    
+    if (mPendingOnsetSamps >= 0 && mPendingOnsetSamps < bufSize)
+    {
+        onsetSample = mPendingOnsetSamps;
+        mPendingOnsetSamps = -1;
+    }
+    else if (mPendingOnsetSamps >= 0)
+        mPendingOnsetSamps -= bufSize;
+    
+    // the read head slope is the phasor frequency for a 1 second window, in delay samples per sample
+    for (int voice = 0; voice < NUM_VOICES; ++voice)
+        mDelaySlope[voice] = atec::Utilities::transpo2freq(mTranspo[voice], 1000.0);
+    
     // copy this block from the host into our ring buffer starting at mRingBufWriteIdx (both channels/all samples)
     mRingBuf.write(buffer);
     
@@ -288,7 +528,7 @@ void MyPitchShiftAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer,
             channelData[sample] = 0.0;
             
             for (int voice = 0; voice < NUM_VOICES; ++voice)
-                channelData[sample] += computeTranspoSamples(voice, channel, sample);
+                channelData[sample] += computeTranspoSamples(voice, channel, sample, sample == onsetSample);
         }
     }
     
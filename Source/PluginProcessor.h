@@ -12,6 +12,16 @@
 
 #define NUM_VOICES 3
 
+// in adaptive mode the grain window is this many detected pitch periods long
+#define ADAPTIVE_WINDOW_PERIODS 3.0
+// window size limits in ms, matching the range of the window size slider
+#define MIN_WINDOW_SIZE_MS 5.0
+#define MAX_WINDOW_SIZE_MS 300.0
+// below this read head slope (about +/-1.7 semitones) grains cycle too slowly to pick up window changes on their own,
+// so they're cycled at FORCED_GRAIN_RATE (a grain every 2 windows) until both readers have the target window
+#define MIN_GRAIN_RATE 0.1
+#define FORCED_GRAIN_RATE 0.5
+
 //==============================================================================
 /**
 */
@@ -63,21 +73,77 @@ public:
     double mWindowSizeMs;
     double mTranspo[NUM_VOICES];
     
-    
-    void setPhasorFreq(double f, int phasorIndex);
+    // when true, the grain window follows the detected pitch period instead of mWindowSizeMs
+    bool mAdaptiveWindow;
 
 private:
     
     atec::RingBuffer mRingBuf;
     
-    atec::LFO mPhasors[NUM_VOICES][2];
+    // one delay line reader. its window (the base delay behind the write head) and starting delay are latched when its grain
+    // starts (envelope at zero) and held for the whole grain. within a grain the delay moves at the slope set by the
+    // transposition alone, so window size changes never move or bend a read head that is playing at nonzero gain
+    struct GrainReader
+    {
+        double windowSizeSamps;
+        double delaySamps;
+    };
+    
+    // readers A and B share a 0-1 grain phase, B half a grain behind A, so they stay locked 180 degrees apart.
+    // the phase speed follows the target window but is frozen for each half grain, so each envelope half is a clean sin quarter
+    struct GrainPair
+    {
+        GrainReader readers[2];
+        double phase;
+        double windowSizeSamps;
+        bool forcedCycling;
+    };
+    
+    // [voice][channel]
+    GrainPair mGrainPairs[NUM_VOICES][2];
+    
+    // after an onset the old grain pair keeps running on its own and is crossfaded out under the new one
+    GrainPair mFadePairs[NUM_VOICES][2];
+    double mFadeGain[NUM_VOICES][2];
+    double mFadeStep;
+    
+    // per voice read head slope (delay samples per sample), set by the transposition alone
+    double mDelaySlope[NUM_VOICES];
+    
+    // the window new grains latch, and the last window set from a detected pitch (0 until the first pitch in adaptive mode)
+    double mTargetWindowSamps;
+    double mAdaptiveWindowSamps;
+    
+    // samples until a detected onset reaches the readers, or -1 if none is pending
+    int mPendingOnsetSamps;
+    
+    // zero-crossing pitch tracker state
+    double mPitchLowpassState;
+    double mPitchLowpassCoeff;
+    bool mPitchArmed;
+    int mSamplesSinceCrossing;
+    double mPitchPeriodSamps;
+    
+    // onset detector state (peak envelope follower and a slow average of it)
+    double mFastEnv;
+    double mSlowEnv;
+    double mFastEnvReleaseCoeff;
+    double mSlowEnvCoeff;
+    bool mOnsetArmed;
     
-    void setPhasorDebug(bool d);
-    void setPhasorType(atec::LFO::LfoType t);
-    void initPhasor();
+    void initReaders();
+    void initAnalysis();
+    int analyseBlock(const juce::AudioBuffer<float>& buffer, int numChannels);
+    double computeTargetWindowSamps(int numSamples);
     
-    double computeTranspoSamples(int voice, int channel, int sample);
-    void computeDelayAndAmp(double phaseSample, double* envSignalPtr, double* delaySignalPtr);
+    double computeTranspoSamples(int voice, int channel, int sample, bool onset);
+    double computeGrainPair(GrainPair& pair, int channel, int sample, double delaySlope, bool* wrappedAPtr);
+    void restartGrainPair(GrainPair& pair, double delaySlope, double windowSizeSamps);
+    bool grainWindowsOutdated(const GrainPair& pair);
+    double nextHalfWindowSamps(double windowSizeSamps);
+    void latchGrain(GrainReader& reader, double phase, double windowSizeSamps);
+    double readGrain(const GrainReader& reader, double phase, int channel, int sample, double* envSignalPtr);
+    void computeDelayAndAmp(double phaseSample, double windowSizeSamps, double* envSignalPtr, double* delaySignalPtr);
     
 
     //==============================================================================